@@ -0,0 +1,188 @@
+#include "affinity.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+huge_page_mode huge_pages = huge_page_mode::transparent;
+bool numa_local_orbits = false;
+
+namespace
+{
+
+constexpr std::size_t huge_page_size = 2U << 20;
+
+// Parses a Linux CPU list like "0-3,8-11"
+std::vector<int> parse_cpu_list(std::string const& list)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ','))
+    {
+        std::size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// NUMA node of each CPU, as read from sysfs; empty if the system doesn't tell
+std::vector<int> const& get_cpu_nodes(void)
+{
+    static std::vector<int> const cpu_nodes = [] {
+        std::vector<int> nodes;
+        std::error_code ec;
+        for (auto const& entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec))
+        {
+            std::string const& name = entry.path().filename().string();
+            if (name.rfind("node", 0) != 0 || name.size() == 4 ||
+                name.find_first_not_of("0123456789", 4) != std::string::npos)
+                continue;
+            std::ifstream in(entry.path() / "cpulist");
+            std::string list;
+            if (!std::getline(in, list) || list.empty())
+                continue;
+            const int node = std::stoi(name.substr(4));
+            for (int cpu : parse_cpu_list(list))
+            {
+                if (cpu >= static_cast<int>(nodes.size()))
+                {
+                    nodes.resize(cpu + 1, 0);
+                }
+                nodes[cpu] = node;
+            }
+        }
+        return nodes;
+    }();
+    return cpu_nodes;
+}
+
+} // namespace
+
+huge_page_mode parse_huge_page_mode(std::string const& mode)
+{
+    if (mode == "none")
+        return huge_page_mode::none;
+    if (mode == "transparent")
+        return huge_page_mode::transparent;
+    if (mode == "explicit")
+        return huge_page_mode::hugetlb;
+    throw std::invalid_argument("huge_pages must be one of none, transparent, explicit");
+}
+
+std::vector<int> get_available_cpus(void)
+{
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    if (cpus.empty())
+    {
+        for (int cpu = 0; cpu < static_cast<int>(std::thread::hardware_concurrency()); ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+bool pin_current_thread(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+int get_numa_node_count(void)
+{
+    std::vector<int> const& nodes = get_cpu_nodes();
+    int count = 1;
+    for (int node : nodes)
+    {
+        count = std::max(count, node + 1);
+    }
+    return count;
+}
+
+int get_cpu_numa_node(int cpu)
+{
+    std::vector<int> const& nodes = get_cpu_nodes();
+    if (cpu >= 0 && cpu < static_cast<int>(nodes.size()))
+        return nodes[cpu];
+    return 0;
+}
+
+int get_current_numa_node(void)
+{
+#ifdef __linux__
+    std::vector<int> const& nodes = get_cpu_nodes();
+    const int cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < static_cast<int>(nodes.size()))
+        return nodes[cpu];
+#endif
+    return 0;
+}
+
+void* allocate_pages(std::size_t& bytes)
+{
+    void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (huge_pages == huge_page_mode::hugetlb)
+    {
+        bytes = (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+        p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (p == MAP_FAILED)
+    {
+        p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+        if (huge_pages != huge_page_mode::none && bytes >= huge_page_size)
+        {
+            madvise(p, bytes, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    return p;
+}
+
+void free_pages(void* p, std::size_t bytes)
+{
+    munmap(p, bytes);
+}
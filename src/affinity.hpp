@@ -0,0 +1,119 @@
+#ifndef __AFFINITY_HPP__
+#define __AFFINITY_HPP__
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+enum class huge_page_mode
+{
+    none,
+    transparent, // ask the kernel to back large buffers with transparent huge pages
+    hugetlb      // explicit huge pages, reserved via vm.nr_hugepages; falls back to normal pages
+};
+
+extern huge_page_mode huge_pages;
+extern bool numa_local_orbits;
+
+extern huge_page_mode parse_huge_page_mode(std::string const& mode);
+extern std::vector<int> get_available_cpus(void);
+extern bool pin_current_thread(int cpu);
+extern int get_numa_node_count(void);
+extern int get_cpu_numa_node(int cpu);
+extern int get_current_numa_node(void);
+extern void* allocate_pages(std::size_t& bytes);
+extern void free_pages(void* p, std::size_t bytes);
+
+/**
+ * Array in anonymous memory that is left untouched on allocation, so that
+ * its pages are placed on the NUMA node of the thread that first writes
+ * to them. All elements read as zero until written.
+ */
+template <typename T> class page_buffer
+{
+  public:
+    page_buffer() = default;
+    page_buffer(page_buffer const&) = delete;
+    page_buffer& operator=(page_buffer const&) = delete;
+
+    page_buffer(page_buffer&& other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)),
+          bytes_(std::exchange(other.bytes_, 0))
+    {
+    }
+
+    ~page_buffer()
+    {
+        release();
+    }
+
+    void allocate(std::size_t count)
+    {
+        release();
+        if (count == 0)
+            return;
+        bytes_ = count * sizeof(T);
+        data_ = static_cast<T*>(allocate_pages(bytes_));
+        size_ = count;
+    }
+
+    // Grows the buffer to hold at least `count` elements, keeping the first
+    // `used` ones; the capacity at least doubles, so growing step by step
+    // copies each element only a few times
+    void grow(std::size_t count, std::size_t used)
+    {
+        if (count <= size_)
+            return;
+        page_buffer bigger;
+        bigger.allocate(std::max(count, 2 * size_));
+        std::copy_n(data_, std::min(used, size_), bigger.data_);
+        std::swap(data_, bigger.data_);
+        std::swap(size_, bigger.size_);
+        std::swap(bytes_, bigger.bytes_);
+    }
+
+    void release(void)
+    {
+        if (data_ != nullptr)
+        {
+            free_pages(data_, bytes_);
+        }
+        data_ = nullptr;
+        size_ = 0;
+        bytes_ = 0;
+    }
+
+    T* data(void)
+    {
+        return data_;
+    }
+
+    T const* data(void) const
+    {
+        return data_;
+    }
+
+    std::size_t size(void) const
+    {
+        return size_;
+    }
+
+    T& operator[](std::size_t i)
+    {
+        return data_[i];
+    }
+
+    T const& operator[](std::size_t i) const
+    {
+        return data_[i];
+    }
+
+  private:
+    T* data_{nullptr};
+    std::size_t size_{0};
+    std::size_t bytes_{0};
+};
+
+#endif // __AFFINITY_HPP__
@@ -0,0 +1,166 @@
+#ifndef __EXPONENTIAL_MAP_HPP__
+#define __EXPONENTIAL_MAP_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numbers>
+#include <vector>
+
+#include <SFML/Graphics/Color.hpp>
+#include <SFML/Graphics/Image.hpp>
+
+#include "affinity.hpp"
+#include "mandelbrot.hpp"
+#include "util.hpp"
+
+namespace
+{
+
+/**
+ * Log-polar strip around a fixed center: each column is an angle, each row
+ * a radius, and the radii shrink exponentially from the outer corner of
+ * the first frame of a zoom down to half a pixel of the last frame. The
+ * angular and radial steps are equal, so a strip pixel is about the size
+ * of a frame pixel at every zoom level. All frames of the zoom are remapped
+ * from the strip instead of being calculated one by one.
+ */
+template <typename FloatType> struct exponential_map
+{
+    FloatType c_real{};
+    FloatType c_imag{};
+    int frame_width{};
+    int frame_height{};
+    int columns{};
+    int rows{};
+    double step{};           // angular step, which is also the step of the logarithmic radius
+    double log_radius_max{}; // natural logarithm of the radius of row 0
+    std::vector<double> cosines;
+    std::vector<double> sines;
+    std::vector<iteration_count_t> max_iterations; // per row
+    // iteration counts are clamped to 32 bits to halve the size of the strip;
+    // the pages of a row are first touched by the worker that calculates it
+    page_buffer<std::uint32_t> iterations;
+    std::atomic<int> completed_rows{0};
+
+    static double log_scale_factor(int width, int height, double zoom_level)
+    {
+        return std::log(4.0 / std::max(width, height)) - zoom_level * std::numbers::ln2;
+    }
+
+    // Outermost pixel of a frame, plus a margin of one pixel
+    static double corner_radius(int width, int height)
+    {
+        return 0.5 * std::hypot(width, height) + 1;
+    }
+
+    static int column_count(int width, int height)
+    {
+        return static_cast<int>(std::ceil(2 * std::numbers::pi * corner_radius(width, height)));
+    }
+
+    static int row_count(int width, int height, double zoom_from, double zoom_to)
+    {
+        const double log_radius_max =
+            log_scale_factor(width, height, zoom_from) + std::log(corner_radius(width, height));
+        const double log_radius_min = log_scale_factor(width, height, zoom_to) + std::log(0.5);
+        const double step = 2 * std::numbers::pi / column_count(width, height);
+        return static_cast<int>(std::ceil((log_radius_max - log_radius_min) / step)) + 1;
+    }
+
+    // Size of the strip of a zoom in bytes
+    static double size_in_bytes(int width, int height, double zoom_from, double zoom_to)
+    {
+        return static_cast<double>(column_count(width, height)) * row_count(width, height, zoom_from, zoom_to) *
+               sizeof(std::uint32_t);
+    }
+
+    template <typename Calculator>
+    void create(Calculator& mandelbrot, FloatType const& center_real, FloatType const& center_imag, double zoom_from,
+                double zoom_to)
+    {
+        c_real = center_real;
+        c_imag = center_imag;
+        frame_width = mandelbrot.width;
+        frame_height = mandelbrot.height;
+        columns = column_count(frame_width, frame_height);
+        rows = row_count(frame_width, frame_height, zoom_from, zoom_to);
+        step = 2 * std::numbers::pi / columns;
+        log_radius_max =
+            log_scale_factor(frame_width, frame_height, zoom_from) + std::log(corner_radius(frame_width, frame_height));
+        cosines.resize(columns);
+        sines.resize(columns);
+        for (int col = 0; col < columns; ++col)
+        {
+            cosines[col] = std::cos(col * step);
+            sines[col] = std::sin(col * step);
+        }
+        // each row gets the iteration limit of the deepest frame it's visible in,
+        // i.e. the frame that has it in its corners
+        max_iterations.resize(rows);
+        for (int row = 0; row < rows; ++row)
+        {
+            const double zoom_level = (std::log(4.0 / std::max(frame_width, frame_height)) +
+                                       std::log(corner_radius(frame_width, frame_height)) - log_radius(row)) /
+                                      std::numbers::ln2;
+            max_iterations[row] =
+                std::min(mandelbrot.max_iterations_limit,
+                         mandelbrot.calculate_max_iterations(std::clamp(zoom_level, zoom_from, zoom_to)));
+        }
+        iterations.allocate(static_cast<std::size_t>(rows) * columns);
+        completed_rows = 0;
+    }
+
+    inline double log_radius(int row) const
+    {
+        return log_radius_max - row * step;
+    }
+
+    inline std::uint32_t* row_data(int row)
+    {
+        return iterations.data() + static_cast<std::size_t>(row) * columns;
+    }
+
+    static std::uint32_t clamp_iterations(iteration_count_t iterations)
+    {
+        return static_cast<std::uint32_t>(
+            std::min(iterations, static_cast<iteration_count_t>(std::numeric_limits<std::uint32_t>::max())));
+    }
+
+    // Maps row y of a frame with the given pixel size from the strip
+    void render_row(sf::Image& image, int y, double scale_factor, const iteration_count_t frame_max_iterations) const
+    {
+        if (image.getSize().x != static_cast<unsigned int>(frame_width))
+        {
+            image.create(frame_width, 1, sf::Color::Transparent);
+        }
+        const double log_scale = std::log(scale_factor);
+        const double dy = y - frame_height / 2.0;
+        for (int x = 0; x < frame_width; ++x)
+        {
+            const double dx = x - frame_width / 2.0;
+            const double d2 = dx * dx + dy * dy;
+            int row = rows - 1;
+            if (d2 > 0)
+            {
+                const double log_r = log_scale + 0.5 * std::log(d2);
+                row = std::clamp(static_cast<int>(std::lround((log_radius_max - log_r) / step)), 0, rows - 1);
+            }
+            double angle = std::atan2(dy, dx);
+            if (angle < 0)
+            {
+                angle += 2 * std::numbers::pi;
+            }
+            const int col = static_cast<int>(std::lround(angle / step)) % columns;
+            const iteration_count_t n = iterations[static_cast<std::size_t>(row) * columns + col];
+            const double hue = static_cast<double>(n) / static_cast<double>(frame_max_iterations);
+            image.setPixel(x, 0, (n < frame_max_iterations) ? get_rainbow_color(hue) : sf::Color::Black);
+        }
+    }
+};
+
+} // namespace
+
+#endif // __EXPONENTIAL_MAP_HPP__
@@ -0,0 +1,114 @@
+#ifndef __JOURNEY_HPP__
+#define __JOURNEY_HPP__
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include <yaml-cpp/yaml.h>
+
+#include "mandelbrot.hpp"
+
+namespace
+{
+
+template <typename FloatType> struct keyframe
+{
+    FloatType c_real{};
+    FloatType c_imag{};
+    double zoom_level{};
+    int frames{60}; // number of frames from this keyframe to the next one
+};
+
+template <typename FloatType> struct frame_position
+{
+    FloatType c_real{};
+    FloatType c_imag{};
+    double zoom_level{};
+};
+
+/**
+ * A single job of a job list: either a zoom into a fixed center
+ * (`zoom` range) or a camera path along keyframes (`path`).
+ */
+template <typename FloatType> struct journey
+{
+    YAML::Node node; // config node of this job, checkpoints are written back into it
+    int width{3840};
+    int height{2160};
+    iteration_count_t base_iterations{100};
+    double log_scale_factor{0.25};
+    iteration_count_t max_iterations_limit{2'000'000'000ULL};
+    double zoom_from{0.25};
+    double zoom_to{1000};
+    double zoom_factor{1.0};
+    double zoom_increment{0.12};
+    FloatType c_real{-0.75};
+    FloatType c_imag{0.0};
+    std::vector<keyframe<FloatType>> path;
+    std::string out_file{"mandelbrot.png"};
+    bool exponential_map{false}; // remap all frames from a single log-polar strip
+    bool distance_estimation{false};
+    int supersampling{1};
+    std::string distance_file; // template for raw float32 files of the distance plane; none if empty
+    int first_frame{0};
+
+    bool is_path(void) const
+    {
+        return !path.empty();
+    }
+
+    template <typename Calculator> void apply_to(Calculator& mandelbrot) const
+    {
+        mandelbrot.width = width;
+        mandelbrot.height = height;
+        mandelbrot.base_iterations = base_iterations;
+        mandelbrot.log_scale_factor = log_scale_factor;
+        mandelbrot.max_iterations_limit = max_iterations_limit;
+        mandelbrot.distance_estimation = distance_estimation;
+        mandelbrot.supersampling = supersampling;
+    }
+
+    std::vector<frame_position<FloatType>> frames(void) const
+    {
+        std::vector<frame_position<FloatType>> result;
+        if (!is_path())
+        {
+            double zoom_level = zoom_from;
+            while (zoom_level <= zoom_to)
+            {
+                result.push_back({c_real, c_imag, zoom_level});
+                const double next_zoom_level = zoom_level * zoom_factor + zoom_increment;
+                if (next_zoom_level <= zoom_level)
+                    break;
+                zoom_level = next_zoom_level;
+            }
+            return result;
+        }
+        for (std::size_t k = 0; k + 1 < path.size(); ++k)
+        {
+            keyframe<FloatType> const& a = path.at(k);
+            keyframe<FloatType> const& b = path.at(k + 1);
+            // pan in step with the view size so that the camera moves
+            // at a constant speed in screen space while zooming
+            const double size_a = std::pow(2.0, -a.zoom_level);
+            const double size_b = std::pow(2.0, -b.zoom_level);
+            for (int i = 0; i < a.frames; ++i)
+            {
+                const double t = static_cast<double>(i) / a.frames;
+                const double zoom_level = a.zoom_level + (b.zoom_level - a.zoom_level) * t;
+                const double u =
+                    (size_a == size_b) ? t : (size_a - std::pow(2.0, -zoom_level)) / (size_a - size_b);
+                result.push_back({a.c_real + (b.c_real - a.c_real) * u, a.c_imag + (b.c_imag - a.c_imag) * u,
+                                  zoom_level});
+            }
+        }
+        keyframe<FloatType> const& last = path.back();
+        result.push_back({last.c_real, last.c_imag, last.zoom_level});
+        return result;
+    }
+};
+
+} // namespace
+
+#endif // __JOURNEY_HPP__
@@ -3,12 +3,14 @@
 #include <cmath>
 #include <condition_variable>
 #include <cstdlib>
+#include <filesystem>
 #include <fstream>
 #include <functional>
 #include <future>
 #include <iomanip>
 #include <iostream>
 #include <locale>
+#include <map>
 #include <mutex>
 #include <queue>
 #include <sstream>
@@ -24,7 +26,12 @@
 #include <yaml-cpp/yaml.h>
 
 #include "1000s.hpp"
+#include "affinity.hpp"
+#include "exponential_map.hpp"
+#include "journey.hpp"
 #include "mandelbrot.hpp"
+#include "mandelbrot_perturbative.hpp"
+#include "orbit_store.hpp"
 #include "util.hpp"
 
 namespace mp = boost::multiprecision;
@@ -36,60 +43,115 @@ using mandelbrot_computer_t = mandelbrot_calculator<FloatType>;
 using palette_t = std::vector<sf::Color>;
 
 int num_threads = static_cast<int>(std::thread::hardware_concurrency());
-double zoom_from = 0.25;
-double zoom_to = 1000;
-double zoom_factor = 1.0;
-double zoom_increment = 0.12;
+bool pin_threads = false;
 int file_index = 0;
-FloatType c_real = -0.75;
-FloatType c_imag = 0.0;
+int checkpoint_job = 0;
+int checkpoint_frame = 0;
 mpfr_prec_t min_precision_bits = 64;
-double log_scale_factor = 0.1;
 palette_t palette;
-std::string out_file = "mandelbrot.png";
 std::string checkpoint_file = "checkpoint.yaml";
 YAML::Node config;
 
-void parse_config_file(std::string const& config_file, mandelbrot_computer_t& mandelbrot)
+journey<FloatType> default_journey(mandelbrot_computer_t const& mandelbrot)
 {
-    config = YAML::LoadFile(config_file);
-    if (config["width"] && config["height"])
+    journey<FloatType> j;
+    j.node.reset(config);
+    j.width = mandelbrot.width;
+    j.height = mandelbrot.height;
+    j.base_iterations = mandelbrot.base_iterations;
+    j.log_scale_factor = mandelbrot.log_scale_factor;
+    j.max_iterations_limit = mandelbrot.max_iterations_limit;
+    return j;
+}
+
+journey<FloatType> parse_journey(YAML::Node node, journey<FloatType> const& defaults)
+{
+    journey<FloatType> j = defaults;
+    j.node.reset(node);
+    j.path.clear();
+    j.first_frame = 0;
+    if (node["width"] && node["height"])
+    {
+        j.width = node["width"].as<int>();
+        j.height = node["height"].as<int>();
+    }
+    if (node["max_iterations_limit"])
+    {
+        j.max_iterations_limit = node["max_iterations_limit"].as<iteration_count_t>();
+    }
+    if (node["base_iterations"])
+    {
+        j.base_iterations = node["base_iterations"].as<iteration_count_t>();
+    }
+    if (node["log_scale_factor"])
     {
-        mandelbrot.width = config["width"].as<int>();
-        mandelbrot.height = config["height"].as<int>();
+        j.log_scale_factor = node["log_scale_factor"].as<double>();
+    }
+    if (node["zoom"]["from"] && node["zoom"]["to"] && node["zoom"]["factor"])
+    {
+        j.zoom_from = node["zoom"]["from"].as<double>();
+        j.zoom_to = node["zoom"]["to"].as<double>();
+        j.zoom_factor = node["zoom"]["factor"].as<double>();
+        j.zoom_increment = node["zoom"]["increment"].as<double>();
+    }
+    if (node["center"]["r"] && node["center"]["i"])
+    {
+        j.c_real = node["center"]["r"].as<FloatType>();
+        j.c_imag = node["center"]["i"].as<FloatType>();
+    }
+    if (node["path"] && node["path"].IsSequence())
+    {
+        for (auto it : node["path"])
+        {
+            keyframe<FloatType> k;
+            k.c_real = it["center"]["r"].as<FloatType>();
+            k.c_imag = it["center"]["i"].as<FloatType>();
+            k.zoom_level = it["zoom"].as<double>();
+            if (it["frames"])
+            {
+                k.frames = it["frames"].as<int>();
+            }
+            j.path.push_back(k);
+        }
     }
-    if (config["max_iterations_limit"])
+    if (node["exponential_map"])
     {
-        mandelbrot.max_iterations_limit = config["max_iterations_limit"].as<iteration_count_t>();
+        j.exponential_map = node["exponential_map"].as<bool>();
     }
-    if (config["base_iterations"])
+    if (node["distance_estimation"])
     {
-        mandelbrot.base_iterations = config["base_iterations"].as<iteration_count_t>();
+        j.distance_estimation = node["distance_estimation"].as<bool>();
     }
-    if (config["log_scale_factor"])
+    if (node["supersampling"])
     {
-        mandelbrot.log_scale_factor = config["log_scale_factor"].as<double>();
+        j.supersampling = node["supersampling"].as<int>();
     }
+    if (node["distance_file"])
+    {
+        j.distance_file = node["distance_file"].as<std::string>();
+    }
+    if (node["out_file"])
+    {
+        j.out_file = node["out_file"].as<std::string>();
+    }
+    return j;
+}
+
+std::vector<journey<FloatType>> parse_config_file(std::string const& config_file,
+                                                  mandelbrot_computer_t const& mandelbrot)
+{
+    config = YAML::LoadFile(config_file);
     if (config["checkpoint"]["file_index"])
     {
         file_index = config["checkpoint"]["file_index"].as<int>();
     }
-    if (config["zoom"]["from"] && config["zoom"]["to"] && config["zoom"]["factor"])
+    if (config["checkpoint"]["job"])
     {
-        zoom_from = config["zoom"]["from"].as<double>();
-        zoom_to = config["zoom"]["to"].as<double>();
-        zoom_factor = config["zoom"]["factor"].as<double>();
-        zoom_increment = config["zoom"]["increment"].as<double>();
+        checkpoint_job = config["checkpoint"]["job"].as<int>();
     }
-    if (config["center"]["r"] && config["center"]["i"])
+    if (config["checkpoint"]["frame"])
     {
-        c_real = config["center"]["r"].as<FloatType>();
-        c_imag = config["center"]["i"].as<FloatType>();
-        // else
-        // {
-        //     c_real.assign(config["center"]["r"].as<std::string>());
-        //     c_imag.assign(config["center"]["i"].as<std::string>());
-        // }
+        checkpoint_frame = config["checkpoint"]["frame"].as<int>();
     }
     if (config["min_precision_bits"])
     {
@@ -99,6 +161,22 @@ void parse_config_file(std::string const& config_file, mandelbrot_computer_t& ma
     {
         num_threads = config["num_threads"].as<int>();
     }
+    if (config["pin_threads"])
+    {
+        pin_threads = config["pin_threads"].as<bool>();
+    }
+    if (config["huge_pages"])
+    {
+        huge_pages = parse_huge_page_mode(config["huge_pages"].as<std::string>());
+    }
+    if (config["numa_local_orbits"])
+    {
+        numa_local_orbits = config["numa_local_orbits"].as<bool>();
+    }
+    if (config["orbit_dir"])
+    {
+        orbit_dir = config["orbit_dir"].as<std::string>();
+    }
     if (config["palette"] || config["palette"].IsSequence())
     {
         auto parse_rgb = [](std::string const& str) -> std::vector<sf::Uint8> {
@@ -124,19 +202,43 @@ void parse_config_file(std::string const& config_file, mandelbrot_computer_t& ma
             }
         }
     }
-    if (config["out_file"])
-    {
-        out_file = config["out_file"].as<std::string>();
-    }
     if (config["checkpoint_file"])
     {
         checkpoint_file = config["checkpoint_file"].as<std::string>();
     }
+    // top-level settings are the defaults for every job of the job list
+    journey<FloatType> const& defaults = parse_journey(config, default_journey(mandelbrot));
+    if (!config["jobs"] || !config["jobs"].IsSequence())
+    {
+        return {defaults};
+    }
+    std::vector<journey<FloatType>> journeys;
+    for (std::size_t i = 0; i < config["jobs"].size(); ++i)
+    {
+        journeys.push_back(parse_journey(config["jobs"][i], defaults));
+    }
+    return journeys;
 }
 
-sf::Image stitch_images(std::vector<sf::Image> const& partial_images, int h, int max_h)
+// Work items for the worker threads
+struct work_queue
+{
+    std::queue<work_item<FloatType>> items;
+    // Mutex to protect the queue
+    std::mutex mtx;
+    // Condition variable to signal when the queue is not empty
+    std::condition_variable cv;
+
+    void push(work_item<FloatType> const& item)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        items.push(item);
+        cv.notify_one();
+    }
+};
+
+sf::Image stitch_images(std::vector<sf::Image> const& partial_images, int w, int h, int max_h)
 {
-    const int w = static_cast<int>(partial_images.front().getSize().x);
     const int n = static_cast<int>(partial_images.size());
     int single_image_height = h / n;
     sf::Image result_image;
@@ -151,191 +253,426 @@ sf::Image stitch_images(std::vector<sf::Image> const& partial_images, int h, int
 int main(int argc, char* argv[])
 {
     mandelbrot_computer_t mandelbrot;
+    std::vector<journey<FloatType>> journeys{default_journey(mandelbrot)};
     if (argc > 1)
     {
-        parse_config_file(argv[1], mandelbrot);
+        journeys = parse_config_file(argv[1], mandelbrot);
     }
     mpfr_set_default_prec(min_precision_bits);
-    if (mandelbrot.height % num_threads != 0)
+    if (!orbit_dir.empty() && !std::filesystem::is_directory(orbit_dir))
     {
-        std::cerr << "Configuration error: image height (" << mandelbrot.height
-                  << ") must be divisible by number of threads (" << num_threads << ")." << std::endl;
+        std::cerr << "Configuration error: orbit_dir (" << orbit_dir << ") is not a directory." << std::endl;
         return EXIT_FAILURE;
     }
+    if (journeys.empty())
+    {
+        std::cerr << "Configuration error: the job list is empty." << std::endl;
+        return EXIT_FAILURE;
+    }
+    for (journey<FloatType> const& j : journeys)
+    {
+        if (j.height % num_threads != 0)
+        {
+            std::cerr << "Configuration error: image height (" << j.height
+                      << ") must be divisible by number of threads (" << num_threads << ")." << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (j.exponential_map && j.is_path())
+        {
+            std::cerr << "Configuration error: an exponential map requires a fixed center, not a path." << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (j.exponential_map && j.distance_estimation)
+        {
+            std::cerr << "Configuration error: distance estimation isn't available with an exponential map."
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (j.supersampling > 1 && !j.distance_estimation)
+        {
+            std::cerr << "Configuration error: supersampling requires distance estimation." << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (j.exponential_map)
+        {
+            const double strip_bytes =
+                exponential_map<FloatType>::size_in_bytes(j.width, j.height, j.zoom_from, j.zoom_to);
+            const std::size_t physical_memory = get_physical_memory();
+            if (physical_memory != 0 && strip_bytes > static_cast<double>(physical_memory))
+            {
+                std::cerr << "Configuration error: the exponential map from zoom " << j.zoom_from << " to "
+                          << j.zoom_to << " takes " << std::fixed << std::setprecision(1) << strip_bytes / (1 << 30)
+                          << " GiB, more than the " << static_cast<double>(physical_memory) / (1 << 30)
+                          << " GiB of physical memory." << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    if (checkpoint_job < static_cast<int>(journeys.size()))
+    {
+        journeys.at(checkpoint_job).first_frame = checkpoint_frame;
+    }
     auto t0 = chrono::system_clock::now();
-    std::cout << "Generating " << mandelbrot.width << 'x' << mandelbrot.height << " image in " << num_threads
-              << " threads. ";
+    std::cout << "Rendering " << journeys.size() << " job" << (journeys.size() == 1 ? "" : "s") << " in "
+              << num_threads << " threads." << std::endl;
     std::cout.imbue(std::locale(std::locale::classic(), new thsds_numpunct));
-    std::cout << "Zooming from " << zoom_from << " to " << zoom_to << '.' << std::endl;
-
-    // Queue that holds the work items
-    std::queue<work_item<FloatType>> work_queue;
 
-    // Mutex to protect the queue
-    std::mutex mtx;
-    // Condition variable to signal when the queue is not empty
-    std::condition_variable cv;
+    // Queues that hold the work items: a single one shared by all workers, or one
+    // per NUMA node if the workers are pinned to CPUs, so that rows stay in memory
+    // local to the node that calculates them. Each node gets a contiguous block of
+    // rows in proportion to its workers, as a huge page of a buffer spans many rows
+    // and lands on the node of the first worker to touch it. Within a node the
+    // rows are shared dynamically by its workers.
+    std::vector<int> const& cpus = get_available_cpus();
+    std::vector<std::size_t> worker_queue(num_threads, 0);
+    std::size_t queue_count = 1;
+    if (pin_threads)
+    {
+        std::map<int, std::size_t> node_queue;
+        for (int i = 0; i < num_threads; ++i)
+        {
+            node_queue.emplace(get_cpu_numa_node(cpus.at(i % cpus.size())), 0);
+        }
+        queue_count = 0;
+        for (auto& [node, queue] : node_queue)
+        {
+            queue = queue_count++;
+        }
+        for (int i = 0; i < num_threads; ++i)
+        {
+            worker_queue[i] = node_queue.at(get_cpu_numa_node(cpus.at(i % cpus.size())));
+        }
+    }
+    std::vector<work_queue> work_queues(queue_count);
+    std::vector<std::size_t> row_queue = worker_queue;
+    std::sort(row_queue.begin(), row_queue.end());
+    auto enqueue = [&work_queues, &row_queue](int row, int rows, work_item<FloatType> const& item) {
+        work_queues.at(row_queue.at(static_cast<std::size_t>(row) * row_queue.size() / rows)).push(item);
+    };
 
-    // Launch worker threads
+    // Launch worker threads, they're shared by all jobs
     std::vector<std::thread> threads;
     for (int i = 0; i < num_threads; ++i)
     {
-        threads.emplace_back([&work_queue, &mtx, &cv, &mandelbrot]() {
+        threads.emplace_back([i, &cpus, &worker_queue, &work_queues, &mandelbrot]() {
+            if (pin_threads && !pin_current_thread(cpus.at(i % cpus.size())))
+            {
+                std::cerr << "Warning: cannot pin worker thread " << i << " to CPU " << cpus.at(i % cpus.size())
+                          << '.' << std::endl;
+            }
+            work_queue& queue = work_queues.at(worker_queue.at(i));
             while (true)
             {
-                std::unique_lock<std::mutex> lock(mtx);
-                cv.wait(lock, [&work_queue] { return !work_queue.empty(); });
-                work_item item = work_queue.front();
-                work_queue.pop();
+                std::unique_lock<std::mutex> lock(queue.mtx);
+                queue.cv.wait(lock, [&queue] { return !queue.items.empty(); });
+                work_item item = queue.items.front();
+                queue.items.pop();
                 lock.unlock();
                 if (item.quit)
                     break;
-                mandelbrot.calculate_mandelbrot_row(item);
+                if (item.allocate_only)
+                {
+                    item.image.create(mandelbrot.width, 1, sf::Color::Transparent);
+                    ++mandelbrot.completed_rows;
+                }
+                else if (item.strip != nullptr && item.from_strip)
+                {
+                    item.strip->render_row(item.image, item.row, item.scale_factor, item.max_iterations);
+                    ++mandelbrot.completed_rows;
+                }
+                else if (item.strip != nullptr)
+                {
+                    mandelbrot.calculate_exponential_map_row(*item.strip, item.row);
+                }
+                else
+                {
+                    mandelbrot.calculate_mandelbrot_row(item);
+                }
             }
         });
     }
 
-    // Create partial images, one per row
-    std::vector<sf::Image> partial_images(mandelbrot.height);
-    for (int row = 0; row < mandelbrot.height; ++row)
-    {
-        partial_images[row].create(mandelbrot.width, 1, sf::Color::Transparent);
-    }
+    // Partial images, one per row; they're allocated by the workers that fill them
+    std::vector<sf::Image> partial_images;
+    // Distance plane of a frame, in pixels; its rows are first touched by the workers that fill them
+    page_buffer<float> distance_plane;
+    sf::Image completed_image;
+    sf::Image no_image;
 
-    // Zoom in
 #ifndef HEADLESS
-    sf::RenderWindow window(sf::VideoMode(mandelbrot.width / 4, mandelbrot.height / 4), "AppleCore");
+    sf::RenderWindow window(sf::VideoMode(journeys.front().width / 4, journeys.front().height / 4), "AppleCore");
     sf::Event event;
     window.clear(sf::Color::Green);
     window.display();
     (void)window.pollEvent(event);
     bool quit_on_next_frame = false;
-    double zoom_level = zoom_from;
-    while (zoom_level <= zoom_to && window.isOpen() && !quit_on_next_frame)
+#endif
+
+#ifndef HEADLESS
+    for (int job_index = checkpoint_job;
+         job_index < static_cast<int>(journeys.size()) && window.isOpen() && !quit_on_next_frame; ++job_index)
 #else
-    double zoom_level = zoom_from;
-    while (zoom_level <= zoom_to)
+    for (int job_index = checkpoint_job; job_index < static_cast<int>(journeys.size()); ++job_index)
 #endif
     {
-        const double scale_factor = 4.0 / std::pow(2.0, zoom_level) / std::max(mandelbrot.width, mandelbrot.height);
-        FloatType real_start = c_real - mandelbrot.width / 2.0 * scale_factor;
-        FloatType imag_start = c_imag - mandelbrot.height / 2.0 * scale_factor;
-        mandelbrot.reset();
-        const iteration_count_t max_iterations =
-            std::min(mandelbrot.max_iterations_limit, mandelbrot.calculate_max_iterations(zoom_level));
-        std::cout << "\rZoom: " << std::setprecision(6) << std::defaultfloat << zoom_level
-                  << "; Δpixel: " << std::scientific << std::setprecision(24) << scale_factor
-                  << "; max. iterations: " << max_iterations
-                  << "; current file index: " << file_index
-                  << "\x1b[K" << std::endl;
-        auto frame_t0 = chrono::system_clock::now();
-
-        // Add work items to queue
-        for (int row = 0; row < mandelbrot.height; ++row)
+        journey<FloatType> const& job = journeys.at(job_index);
+        job.apply_to(mandelbrot);
+#ifndef HEADLESS
+        // the preview shows the frames of each job at a quarter of their size
+        window.setSize(sf::Vector2u(mandelbrot.width / 4, mandelbrot.height / 4));
+        window.setView(sf::View(sf::FloatRect(0, 0, mandelbrot.width / 4.0f, mandelbrot.height / 4.0f)));
+#endif
+        if (partial_images.size() != static_cast<std::size_t>(mandelbrot.height) ||
+            partial_images.front().getSize().x != static_cast<unsigned int>(mandelbrot.width))
         {
-            std::lock_guard<std::mutex> lock(mtx);
-            work_queue.emplace(work_item<FloatType>{.image = std::ref(partial_images[row]),
-                                                    .scale_factor = scale_factor,
-                                                    .real_start = real_start,
-                                                    .imag_start = imag_start,
-                                                    .row = row,
-                                                    .max_iterations = max_iterations});
-            cv.notify_one();
+            // the workers allocate the row images before the first frame
+            partial_images.resize(mandelbrot.height);
+            mandelbrot.reset();
+            for (int row = 0; row < mandelbrot.height; ++row)
+            {
+                enqueue(row, mandelbrot.height, work_item<FloatType>{.image = std::ref(partial_images[row]),
+                                                                     .row = row,
+                                                                     .allocate_only = true});
+            }
+            while (mandelbrot.completed_rows < mandelbrot.height)
+            {
+                using namespace std::chrono_literals;
+                std::this_thread::sleep_for(1ms);
+            }
+        }
+        distance_plane.release();
+        if (job.distance_estimation)
+        {
+            distance_plane.allocate(static_cast<std::size_t>(mandelbrot.width) * mandelbrot.height);
+        }
+        std::vector<frame_position<FloatType>> const& frames = job.frames();
+        std::cout << "Job " << (job_index + 1) << " of " << journeys.size() << ": generating " << frames.size()
+                  << ' ' << mandelbrot.width << 'x' << mandelbrot.height << " images. ";
+        if (job.is_path())
+        {
+            std::cout << "Following a path along " << job.path.size() << " keyframes." << std::endl;
+        }
+        else
+        {
+            std::cout << "Zooming from " << std::setprecision(6) << std::defaultfloat << job.zoom_from << " to "
+                      << job.zoom_to << '.' << std::endl;
         }
 
-#ifndef HEADLESS
-        sf::Vector2i last_mouse_pos = sf::Mouse::getPosition(window);
-        while (mandelbrot.completed_rows < mandelbrot.height && window.isOpen())
+        // Calculate the exponential map all frames of the zoom are remapped from
+        exponential_map<FloatType> strip;
+        if (job.exponential_map)
         {
-            int last_completed_rows = mandelbrot.completed_rows;
-            while (mandelbrot.completed_rows <= last_completed_rows && window.isOpen() &&
-                   last_mouse_pos == sf::Mouse::getPosition(window))
+            strip.create(mandelbrot, job.c_real, job.c_imag, job.zoom_from, job.zoom_to);
+            // the reference for the strip is picked in the deepest frame of the zoom
+            mandelbrot.prepare(job.c_real, job.c_imag,
+                               4.0 / std::pow(2.0, job.zoom_to) / std::max(mandelbrot.width, mandelbrot.height),
+                               strip.max_iterations.back());
+            std::cout << "Calculating " << strip.columns << 'x' << strip.rows << " exponential map ("
+                      << std::fixed << std::setprecision(1)
+                      << static_cast<double>(strip.iterations.size() * sizeof(std::uint32_t)) / (1 << 20) << " MiB)."
+                      << std::endl;
+            for (int row = 0; row < strip.rows; ++row)
             {
-                sf::sleep(sf::milliseconds(100));
+                enqueue(row, strip.rows, work_item<FloatType>{.image = no_image, .row = row, .strip = &strip});
             }
-            last_mouse_pos = sf::Mouse::getPosition(window);
-            std::cout << "\r" << mandelbrot.completed_rows << " of " << mandelbrot.height << " rows completed ("
-                      << std::fixed << std::setprecision(1) << (100.0 * mandelbrot.completed_rows / mandelbrot.height)
-                      << "%)\x1b[K" << std::flush;
-            while (window.pollEvent(event))
+            while (strip.completed_rows < strip.rows)
             {
-                switch (event.type)
+                using namespace std::chrono_literals;
+                std::this_thread::sleep_for(100ms);
+                std::cout << "\r" << strip.completed_rows << " of " << strip.rows << " rows completed ("
+                          << std::fixed << std::setprecision(1) << (100.0 * strip.completed_rows / strip.rows)
+                          << "%)\x1b[K" << std::flush;
+#ifndef HEADLESS
+                while (window.pollEvent(event))
                 {
-                case sf::Event::Closed:
-                    window.close();
-                    break;
-                case sf::Event::KeyPressed:
-                    if ((event.key.system || event.key.control) && event.key.code == sf::Keyboard::C)
+                    if (event.type == sf::Event::Closed)
                     {
-                        sf::Vector2i const& mouse_pos = sf::Mouse::getPosition(window);
-                        std::ostringstream coords_ss;
-                        FloatType const& pixel_real = real_start + mouse_pos.x * scale_factor;
-                        FloatType const& pixel_imag = imag_start + mouse_pos.y * scale_factor;
-                        coords_ss << "r: " << pixel_real << "\n" << "i: " << pixel_imag;
-                        sf::Clipboard::setString(coords_ss.str());
+                        window.close();
                     }
-                    else if (event.key.code == sf::Keyboard::Q)
+                    else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::Q)
                     {
                         quit_on_next_frame = true;
                     }
-                    break;
-                default:
-                    break;
                 }
+#endif
             }
-            window.clear();
-            sf::Image const& intermediate_image = stitch_images(partial_images, mandelbrot.height, mandelbrot.completed_rows);
-            sf::Texture tex;
-            tex.loadFromImage(intermediate_image);
-            sf::Sprite sprite(tex);
-            sprite.setScale(0.25, 0.25);
-            window.draw(sprite);
-            window.display();
+            std::cout << std::endl;
         }
+
+        // Zoom in
+#ifndef HEADLESS
+        for (int frame_index = job.first_frame;
+             frame_index < static_cast<int>(frames.size()) && window.isOpen() && !quit_on_next_frame; ++frame_index)
 #else
-        while (mandelbrot.completed_rows < mandelbrot.height)
+        for (int frame_index = job.first_frame; frame_index < static_cast<int>(frames.size()); ++frame_index)
+#endif
         {
-            using namespace std::chrono_literals;
-            std::this_thread::sleep_for(100ms);
-        }
+            FloatType const& c_real = frames.at(frame_index).c_real;
+            FloatType const& c_imag = frames.at(frame_index).c_imag;
+            const double zoom_level = frames.at(frame_index).zoom_level;
+            const double scale_factor =
+                4.0 / std::pow(2.0, zoom_level) / std::max(mandelbrot.width, mandelbrot.height);
+            FloatType real_start = c_real - mandelbrot.width / 2.0 * scale_factor;
+            FloatType imag_start = c_imag - mandelbrot.height / 2.0 * scale_factor;
+            mandelbrot.reset();
+            const iteration_count_t max_iterations =
+                std::min(mandelbrot.max_iterations_limit, mandelbrot.calculate_max_iterations(zoom_level));
+            std::cout << "\rZoom: " << std::setprecision(6) << std::defaultfloat << zoom_level
+                      << "; Δpixel: " << std::scientific << std::setprecision(24) << scale_factor
+                      << "; max. iterations: " << max_iterations
+                      << "; current file index: " << file_index
+                      << "\x1b[K" << std::endl;
+            auto frame_t0 = chrono::system_clock::now();
+
+            if (job.exponential_map)
+            {
+                // Add work items that map the rows of the frame from the strip to queue
+                for (int row = 0; row < mandelbrot.height; ++row)
+                {
+                    enqueue(row, mandelbrot.height, work_item<FloatType>{.image = std::ref(partial_images[row]),
+                                                                         .scale_factor = scale_factor,
+                                                                         .row = row,
+                                                                         .max_iterations = max_iterations,
+                                                                         .strip = &strip,
+                                                                         .from_strip = true});
+                }
+            }
+            else
+            {
+                mandelbrot.prepare(c_real, c_imag, scale_factor, max_iterations);
+
+                // Add work items to queue
+                for (int row = 0; row < mandelbrot.height; ++row)
+                {
+                    float* distances = job.distance_estimation
+                                           ? distance_plane.data() + static_cast<std::size_t>(row) * mandelbrot.width
+                                           : nullptr;
+                    enqueue(row, mandelbrot.height, work_item<FloatType>{.image = std::ref(partial_images[row]),
+                                                                         .scale_factor = scale_factor,
+                                                                         .real_start = real_start,
+                                                                         .imag_start = imag_start,
+                                                                         .row = row,
+                                                                         .max_iterations = max_iterations,
+                                                                         .distances = distances});
+                }
+            }
+
+#ifndef HEADLESS
+            sf::Vector2i last_mouse_pos = sf::Mouse::getPosition(window);
+            while (mandelbrot.completed_rows < mandelbrot.height && window.isOpen())
+            {
+                int last_completed_rows = mandelbrot.completed_rows;
+                while (mandelbrot.completed_rows <= last_completed_rows && window.isOpen() &&
+                       last_mouse_pos == sf::Mouse::getPosition(window))
+                {
+                    sf::sleep(sf::milliseconds(100));
+                }
+                last_mouse_pos = sf::Mouse::getPosition(window);
+                std::cout << "\r" << mandelbrot.completed_rows << " of " << mandelbrot.height << " rows completed ("
+                          << std::fixed << std::setprecision(1)
+                          << (100.0 * mandelbrot.completed_rows / mandelbrot.height) << "%)\x1b[K" << std::flush;
+                while (window.pollEvent(event))
+                {
+                    switch (event.type)
+                    {
+                    case sf::Event::Closed:
+                        window.close();
+                        break;
+                    case sf::Event::KeyPressed:
+                        if ((event.key.system || event.key.control) && event.key.code == sf::Keyboard::C)
+                        {
+                            sf::Vector2i const& mouse_pos = sf::Mouse::getPosition(window);
+                            std::ostringstream coords_ss;
+                            FloatType const& pixel_real = real_start + mouse_pos.x * scale_factor;
+                            FloatType const& pixel_imag = imag_start + mouse_pos.y * scale_factor;
+                            coords_ss << "r: " << pixel_real << "\n" << "i: " << pixel_imag;
+                            sf::Clipboard::setString(coords_ss.str());
+                        }
+                        else if (event.key.code == sf::Keyboard::Q)
+                        {
+                            quit_on_next_frame = true;
+                        }
+                        break;
+                    default:
+                        break;
+                    }
+                }
+                window.clear();
+                sf::Image const& intermediate_image =
+                    stitch_images(partial_images, mandelbrot.width, mandelbrot.height, mandelbrot.completed_rows);
+                sf::Texture tex;
+                tex.loadFromImage(intermediate_image);
+                sf::Sprite sprite(tex);
+                sprite.setScale(0.25, 0.25);
+                window.draw(sprite);
+                window.display();
+            }
 #endif
-        std::cout << "\rStitching final image ... \x1b[K" << std::flush;
-        sf::Image const& completed_image = stitch_images(partial_images, mandelbrot.height, mandelbrot.height);
-        std::string fidx = std::to_string(file_index);
-        fidx = std::string(6U - fidx.length(), '0') + fidx;
-        std::string png_file = replace_substring(out_file, "{file_index}", fidx);
-        png_file = replace_substring(png_file, "{max_iterations}", std::to_string(max_iterations));
-        png_file = replace_substring(png_file, "{log_scale_factor}", std::to_string(log_scale_factor));
-        png_file = replace_substring(png_file, "{zoom_level}", std::to_string(zoom_level));
-        png_file = replace_substring(png_file, "{size}",
-                                     std::to_string(mandelbrot.width) + 'x' + std::to_string(mandelbrot.height));
-        std::cout << "\rWriting image to " << png_file << "\x1b[K" << std::endl;
-        completed_image.saveToFile(png_file);
-        auto now = chrono::system_clock::now();
-        std::cout << "Elapsed time: " << format_duration(now - frame_t0) << std::endl;
+            // Wait for all rows, also if the window was closed: queued rows refer to the
+            // frame's start point and to the strip, which must not go away before them
+            while (mandelbrot.completed_rows < mandelbrot.height)
+            {
+                using namespace std::chrono_literals;
+                std::this_thread::sleep_for(100ms);
+            }
+            std::cout << "\rStitching final image ... \x1b[K" << std::flush;
+            completed_image = stitch_images(partial_images, mandelbrot.width, mandelbrot.height, mandelbrot.height);
+            std::string fidx = std::to_string(file_index);
+            fidx = std::string(6U - fidx.length(), '0') + fidx;
+            std::string png_file = replace_substring(job.out_file, "{file_index}", fidx);
+            png_file = replace_substring(png_file, "{job_index}", std::to_string(job_index));
+            png_file = replace_substring(png_file, "{max_iterations}", std::to_string(max_iterations));
+            png_file = replace_substring(png_file, "{log_scale_factor}", std::to_string(mandelbrot.log_scale_factor));
+            png_file = replace_substring(png_file, "{zoom_level}", std::to_string(zoom_level));
+            png_file = replace_substring(png_file, "{size}",
+                                         std::to_string(mandelbrot.width) + 'x' + std::to_string(mandelbrot.height));
+            std::cout << "\rWriting image to " << png_file << "\x1b[K" << std::endl;
+            completed_image.saveToFile(png_file);
+            if (job.distance_estimation && !job.distance_file.empty())
+            {
+                std::string const& distance_file = replace_substring(job.distance_file, "{file_index}", fidx);
+                std::cout << "Writing distances to " << distance_file << std::endl;
+                std::ofstream distances(distance_file, std::ios::binary | std::ios::trunc);
+                distances.write(reinterpret_cast<char const*>(distance_plane.data()),
+                                static_cast<std::streamsize>(distance_plane.size() * sizeof(float)));
+            }
+            auto now = chrono::system_clock::now();
+            std::cout << "Elapsed time: " << format_duration(now - frame_t0) << std::endl;
 
-        ++file_index;
-        zoom_level = zoom_level * zoom_factor + zoom_increment;
+            ++file_index;
 
-        config["zoom"]["from"] = zoom_level;
-        config["checkpoint"]["file_index"] = file_index;
-        config["checkpoint"]["zoom"] = 1.0 / scale_factor;
-        config["checkpoint"]["t0"] = get_iso_timestamp(t0);
-        config["checkpoint"]["now"] = get_current_iso_timestamp();
-        config["checkpoint"]["elapsed_total"] = format_duration(now - t0);
-        config["checkpoint"]["elapsed_last_frame"] = format_duration(now - frame_t0);
+            if (job.is_path())
+            {
+                config["checkpoint"]["frame"] = frame_index + 1;
+            }
+            else
+            {
+                // the whole range is written, as the job may have inherited it from the top level
+                YAML::Node job_node = job.node;
+                job_node["zoom"]["from"] = zoom_level * job.zoom_factor + job.zoom_increment;
+                job_node["zoom"]["to"] = job.zoom_to;
+                job_node["zoom"]["factor"] = job.zoom_factor;
+                job_node["zoom"]["increment"] = job.zoom_increment;
+                config["checkpoint"]["frame"] = 0;
+            }
+            config["checkpoint"]["job"] = job_index;
+            config["checkpoint"]["file_index"] = file_index;
+            config["checkpoint"]["zoom"] = 1.0 / scale_factor;
+            config["checkpoint"]["t0"] = get_iso_timestamp(t0);
+            config["checkpoint"]["now"] = get_current_iso_timestamp();
+            config["checkpoint"]["elapsed_total"] = format_duration(now - t0);
+            config["checkpoint"]["elapsed_last_frame"] = format_duration(now - frame_t0);
 
-        std::string const& checkpoint_out_filename = replace_substring(checkpoint_file, "{file_index}", fidx);
-        std::ofstream checkpoint(checkpoint_out_filename, std::ios::trunc);
-        checkpoint << config;
+            std::string const& checkpoint_out_filename = replace_substring(checkpoint_file, "{file_index}", fidx);
+            std::ofstream checkpoint(checkpoint_out_filename, std::ios::trunc);
+            checkpoint << config;
+        }
     }
 
     // Signal all threads to terminate
     for (int i = 0; i < num_threads; ++i)
     {
-        std::lock_guard<std::mutex> lock(mtx);
-        work_queue.emplace(work_item<FloatType>{.image = partial_images[i], .quit = true});
-        cv.notify_one();
+        work_queues.at(worker_queue.at(i)).push(work_item<FloatType>{.image = no_image, .quit = true});
     }
 
     // Wait for threads to complete
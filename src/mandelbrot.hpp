@@ -1,9 +1,11 @@
 #ifndef __MANDELBROT_HPP__
 #define __MANDELBROT_HPP__
 
+#include <algorithm>
 #include <atomic>
 #include <cmath>
 #include <complex>
+#include <cstdint>
 #include <future>
 #include <iostream>
 #include <mutex>
@@ -22,6 +24,71 @@ namespace
 using iteration_count_t = uint64_t;
 namespace mp = boost::multiprecision;
 
+template <typename FloatType> struct exponential_map;
+
+struct distance_estimate
+{
+    iteration_count_t iterations;
+    double distance; // estimated distance to the Mandelbrot set, 0 inside
+};
+
+// Squared radius an escaped orbit is continued to before its distance is estimated
+constexpr double distance_escape_radius2 = 1e6;
+
+// Estimated distance of an escaped point c to the Mandelbrot set, given the
+// orbit value z and the derivative dz/dc at escape time. The orbit is first
+// continued to a larger radius, which makes the estimate much more accurate
+// without changing the iteration count.
+inline double estimate_distance(double zx, double zy, double dx, double dy, const double cx, const double cy)
+{
+    for (int i = 0; i < 64 && zx * zx + zy * zy < distance_escape_radius2; ++i)
+    {
+        const double next_dx = 2 * (zx * dx - zy * dy) + 1;
+        dy = 2 * (zx * dy + zy * dx);
+        dx = next_dx;
+        const double next_zx = zx * zx - zy * zy + cx;
+        zy = 2 * zx * zy + cy;
+        zx = next_zx;
+    }
+    const double r = std::hypot(zx, zy);
+    return 2 * r * std::log(r) / std::hypot(dx, dy);
+}
+
+// Colour of an escaped point; points closer to the set than a pixel are
+// darkened so that thin filaments show up without oversampling
+inline sf::Color get_distance_color(const iteration_count_t iterations, const double pixel_distance,
+                                    const iteration_count_t max_iterations)
+{
+    if (iterations >= max_iterations)
+        return sf::Color::Black;
+    const sf::Color color = get_rainbow_color(static_cast<double>(iterations) / static_cast<double>(max_iterations));
+    const double shade = std::sqrt(std::clamp(pixel_distance, 0.0, 1.0));
+    return sf::Color(static_cast<sf::Uint8>(color.r * shade), static_cast<sf::Uint8>(color.g * shade),
+                     static_cast<sf::Uint8>(color.b * shade));
+}
+
+// Averages n×n samples of a pixel; `sample` gets the offset of a sample from
+// the pixel in pixels and returns its colour
+template <typename Sampler> sf::Color supersample_pixel(const int n, Sampler sample)
+{
+    unsigned int r = 0;
+    unsigned int g = 0;
+    unsigned int b = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        for (int j = 0; j < n; ++j)
+        {
+            const sf::Color color = sample((i + 0.5) / n - 0.5, (j + 0.5) / n - 0.5);
+            r += color.r;
+            g += color.g;
+            b += color.b;
+        }
+    }
+    const unsigned int samples = static_cast<unsigned int>(n * n);
+    return sf::Color(static_cast<sf::Uint8>(r / samples), static_cast<sf::Uint8>(g / samples),
+                     static_cast<sf::Uint8>(b / samples));
+}
+
 template <typename FloatType> struct work_item
 {
     sf::Image& image;
@@ -31,6 +98,10 @@ template <typename FloatType> struct work_item
     const int row{};
     const int radius{1}; // needed by perturbative calculator
     const iteration_count_t max_iterations{};
+    float* distances{nullptr}; // row of the frame's distance plane (in pixels), if any
+    exponential_map<FloatType>* strip{nullptr}; // set if the row belongs to an exponential map
+    bool from_strip{false}; // with `strip`: map a row of a frame from the strip instead of calculating a strip row
+    bool allocate_only{false}; // only create the row image, in memory local to the worker
     bool quit{false};
 };
 
@@ -42,12 +113,19 @@ template <typename FloatType> struct mandelbrot_calculator
     std::atomic<int> completed_rows = 0;
     int width = 3840;
     int height = 2160;
+    bool distance_estimation = false;
+    int supersampling = 1; // n×n samples for escaped pixels closer to the set than a pixel
 
     void reset(void)
     {
         completed_rows = 0;
     }
 
+    void prepare(FloatType const&, FloatType const&, const double, const iteration_count_t)
+    {
+        // direct calculation doesn't need a reference orbit
+    }
+
     inline iteration_count_t calculate(FloatType const& x0, FloatType const& y0, const iteration_count_t max_iterations)
     {
         FloatType x = 0;
@@ -66,19 +144,91 @@ template <typename FloatType> struct mandelbrot_calculator
         return iterations;
     }
 
+    inline distance_estimate calculate_distance(FloatType const& x0, FloatType const& y0,
+                                                const iteration_count_t max_iterations)
+    {
+        FloatType x = 0;
+        FloatType y = 0;
+        FloatType x2 = 0;
+        FloatType y2 = 0;
+        // derivative dz/dc
+        double dx = 0;
+        double dy = 0;
+        iteration_count_t iterations = 0ULL;
+        while (x2 + y2 <= 4 && iterations < max_iterations)
+        {
+            // dz' = 2·z·dz + 1
+            const double zx = static_cast<double>(x);
+            const double zy = static_cast<double>(y);
+            const double next_dx = 2 * (zx * dx - zy * dy) + 1;
+            dy = 2 * (zx * dy + zy * dx);
+            dx = next_dx;
+            y = 2 * x * y + y0;
+            x = x2 - y2 + x0;
+            x2 = x * x;
+            y2 = y * y;
+            ++iterations;
+        }
+        if (iterations >= max_iterations)
+            return {iterations, 0};
+        return {iterations, estimate_distance(static_cast<double>(x), static_cast<double>(y), dx, dy,
+                                              static_cast<double>(x0), static_cast<double>(y0))};
+    }
+
     void calculate_mandelbrot_row(work_item<FloatType> const& w)
     {
+        if (w.image.getSize().x != static_cast<unsigned int>(width))
+        {
+            // allocated by the worker that fills the row, so it lands in the worker's local memory
+            w.image.create(width, 1, sf::Color::Transparent);
+        }
         for (int x = 0; x < width; ++x)
         {
             FloatType const& pixel_real = w.real_start + w.scale_factor * x;
             FloatType const& pixel_imag = w.imag_start + w.scale_factor * w.row;
-            const iteration_count_t iterations = calculate(pixel_real, pixel_imag, w.max_iterations);
-            const double hue = static_cast<double>(iterations) / static_cast<double>(w.max_iterations);
-            w.image.setPixel(x, 0, (iterations < w.max_iterations) ? get_rainbow_color(hue) : sf::Color::Black);
+            if (!distance_estimation)
+            {
+                const iteration_count_t iterations = calculate(pixel_real, pixel_imag, w.max_iterations);
+                const double hue = static_cast<double>(iterations) / static_cast<double>(w.max_iterations);
+                w.image.setPixel(x, 0, (iterations < w.max_iterations) ? get_rainbow_color(hue) : sf::Color::Black);
+                continue;
+            }
+            const distance_estimate de = calculate_distance(pixel_real, pixel_imag, w.max_iterations);
+            const double pixel_distance = de.distance / w.scale_factor;
+            if (w.distances != nullptr)
+            {
+                w.distances[x] = static_cast<float>(pixel_distance);
+            }
+            if (supersampling > 1 && de.iterations < w.max_iterations && pixel_distance < 1)
+            {
+                w.image.setPixel(x, 0, supersample_pixel(supersampling, [&](double dx, double dy) {
+                                     const distance_estimate sample =
+                                         calculate_distance(pixel_real + w.scale_factor * dx,
+                                                            pixel_imag + w.scale_factor * dy, w.max_iterations);
+                                     return get_distance_color(sample.iterations, sample.distance / w.scale_factor,
+                                                               w.max_iterations);
+                                 }));
+                continue;
+            }
+            w.image.setPixel(x, 0, get_distance_color(de.iterations, pixel_distance, w.max_iterations));
         }
         ++completed_rows;
     }
 
+    void calculate_exponential_map_row(exponential_map<FloatType>& strip, const int row)
+    {
+        const double radius = std::exp(strip.log_radius(row));
+        const iteration_count_t max_iterations = strip.max_iterations.at(row);
+        std::uint32_t* data = strip.row_data(row);
+        for (int col = 0; col < strip.columns; ++col)
+        {
+            FloatType const& point_real = strip.c_real + radius * strip.cosines[col];
+            FloatType const& point_imag = strip.c_imag + radius * strip.sines[col];
+            data[col] = strip.clamp_iterations(calculate(point_real, point_imag, max_iterations));
+        }
+        ++strip.completed_rows;
+    }
+
     iteration_count_t calculate_max_iterations(double zoom_level)
     {
         iteration_count_t max_iterations =
@@ -1,34 +1,32 @@
 #ifndef __MANDELBROT_PERTURBATIVE_HPP__
 #define __MANDELBROT_PERTURBATIVE_HPP__
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "affinity.hpp"
+#include "orbit_store.hpp"
+
 template <typename FloatType> struct mandelbrot_calculator_perturbative
 {
     using ComplexType = std::complex<FloatType>;
+    // the reference orbit is stored in the precision the perturbation is calculated in
+    using OrbitPointType = std::complex<double>;
 
-    struct thread_param
-    {
-        sf::Image& image;
-        const double scale_factor;
-        FloatType const& real_start;
-        FloatType const& imag_start;
-        const int start_row;
-        const int end_row;
-        const int radius{1}; // needed by perturbative calculator
-        const iteration_count_t max_iterations;
-    };
     iteration_count_t base_iterations{1000};
     double log_scale_factor{0.1};
     iteration_count_t max_iterations_limit{2'000'000'000ULL};
     std::atomic<int> completed_rows{0};
     int width{3840};
     int height{2160};
-
-    struct ExplorationResult
-    {
-        int x;
-        int y;
-        iteration_count_t iterations;
-    };
+    bool distance_estimation{false};
+    int supersampling{1}; // n×n samples for escaped pixels closer to the set than a pixel
 
     iteration_count_t calculate_max_iterations(double zoom_level)
     {
@@ -37,91 +35,307 @@ template <typename FloatType> struct mandelbrot_calculator_perturbative
         return max_iterations;
     }
 
+    /**
+     * Orbit of the reference point, calculated with full precision and stored
+     * with reduced precision. If the reference doesn't change from one frame
+     * to the next, the orbit is extended instead of being recalculated. An
+     * orbit that escapes ends with its first point outside the bailout radius.
+     */
     struct ReferenceOrbit
     {
-        std::vector<ComplexType> trajectory;
-        iteration_count_t reference_iterations;
+        orbit_store<OrbitPointType> trajectory;
+        ComplexType center;
+        OrbitPointType reduced_center;
+        FloatType x{0};
+        FloatType y{0};
+        FloatType x2{0};
+        FloatType y2{0};
+        iteration_count_t reference_iterations{0};
+        std::atomic<std::uint64_t> generation{0}; // changes whenever the trajectory is restarted
 
-        void compute(ComplexType const& center, iteration_count_t max_iterations)
+        void compute(ComplexType const& c, iteration_count_t max_iterations)
         {
-            trajectory.clear();
-            FloatType x = 0;
-            FloatType y = 0;
-            FloatType x2 = 0;
-            FloatType y2 = 0;
-            iteration_count_t iterations = 0;
-            while (x2 + y2 <= 4 && iterations < max_iterations)
+            if (c != center || trajectory.empty())
+            {
+                ++generation;
+                trajectory.clear();
+                center = c;
+                reduced_center = OrbitPointType(static_cast<double>(c.real()), static_cast<double>(c.imag()));
+                x = 0;
+                y = 0;
+                x2 = 0;
+                y2 = 0;
+                reference_iterations = 0;
+            }
+            while (x2 + y2 <= 4 && reference_iterations < max_iterations)
             {
-                trajectory.emplace_back(x, y);
+                trajectory.push_back(OrbitPointType(static_cast<double>(x), static_cast<double>(y)));
                 y = 2 * x * y + center.imag();
                 x = x2 - y2 + center.real();
                 x2 = x * x;
                 y2 = y * y;
-                ++iterations;
+                ++reference_iterations;
+            }
+            if (escaped() && trajectory.count() == reference_iterations)
+            {
+                trajectory.push_back(OrbitPointType(static_cast<double>(x), static_cast<double>(y)));
             }
-            reference_iterations = iterations;
+            trajectory.flush();
+        }
+
+        bool escaped(void) const
+        {
+            return x2 + y2 > 4;
         }
     };
 
-    iteration_count_t approximate_iterations(const ReferenceOrbit& reference, const ComplexType& delta_c)
+    // Copy of the reference orbit in memory local to one NUMA node
+    struct LocalOrbit
+    {
+        std::mutex mtx;
+        std::atomic<std::uint64_t> generation{0};
+        std::atomic<std::size_t> length{0}; // number of points copied
+        page_buffer<OrbitPointType> trajectory;
+    };
+
+    ReferenceOrbit reference;
+    std::vector<std::unique_ptr<LocalOrbit>> local_orbits;
+    // center of the frame relative to the reference point
+    double center_offset_real{0};
+    double center_offset_imag{0};
+    // probes per row and column of a frame when looking for a reference that doesn't escape
+    static constexpr int probe_grid{16};
+
+    void reset(void)
+    {
+        completed_rows = 0;
+    }
+
+    // Picks the reference point of a frame: the current one as long as it's
+    // inside the frame and hasn't escaped, else the center of the frame or,
+    // if that escapes, the deepest iterating point of a grid of probes
+    void prepare(FloatType const& c_real, FloatType const& c_imag, const double scale_factor,
+                 const iteration_count_t max_iterations)
     {
-        using PerturbationType = std::complex<double>;
-        PerturbationType z_perturb(0, 0);
-        PerturbationType delta(static_cast<double>(delta_c.real()), static_cast<double>(delta_c.imag()));
-        for (size_t n = 0; n < reference.trajectory.size(); ++n)
+        const bool keep_reference =
+            !reference.trajectory.empty() && !reference.escaped() &&
+            std::abs(static_cast<double>(FloatType(c_real - reference.center.real()))) <= scale_factor * width / 2 &&
+            std::abs(static_cast<double>(FloatType(c_imag - reference.center.imag()))) <= scale_factor * height / 2;
+        if (keep_reference)
+        {
+            reference.compute(reference.center, max_iterations);
+        }
+        else
+        {
+            reference.compute(ComplexType(c_real, c_imag), max_iterations);
+        }
+        if (reference.escaped())
         {
-            PerturbationType ref_z(static_cast<double>(reference.trajectory.at(n).real()),
-                                   static_cast<double>(reference.trajectory.at(n).imag()));
-            z_perturb = 2.0 * ref_z * z_perturb + z_perturb * z_perturb + delta;
-            if (std::norm(z_perturb) > 4)
-                return n;
+            OrbitPointType const* orbit = reference.trajectory.data();
+            const iteration_count_t orbit_length = reference.trajectory.size();
+            iteration_count_t best_iterations = reference.reference_iterations;
+            double best_real = 0;
+            double best_imag = 0;
+            for (int j = 0; j < probe_grid && best_iterations < max_iterations; ++j)
+            {
+                const double probe_imag = scale_factor * ((j + 0.5) * height / probe_grid - height / 2.0);
+                for (int i = 0; i < probe_grid && best_iterations < max_iterations; ++i)
+                {
+                    const double probe_real = scale_factor * ((i + 0.5) * width / probe_grid - width / 2.0);
+                    const iteration_count_t iterations =
+                        approximate_iterations(orbit, orbit_length, max_iterations, probe_real, probe_imag);
+                    if (iterations > best_iterations)
+                    {
+                        best_iterations = iterations;
+                        best_real = probe_real;
+                        best_imag = probe_imag;
+                    }
+                }
+            }
+            if (best_iterations > reference.reference_iterations)
+            {
+                reference.compute(ComplexType(FloatType(reference.center.real() + best_real),
+                                              FloatType(reference.center.imag() + best_imag)),
+                                  max_iterations);
+            }
+        }
+        center_offset_real = static_cast<double>(FloatType(c_real - reference.center.real()));
+        center_offset_imag = static_cast<double>(FloatType(c_imag - reference.center.imag()));
+        if (numa_local_orbits && local_orbits.empty())
+        {
+            for (int node = 0; node < get_numa_node_count(); ++node)
+            {
+                local_orbits.push_back(std::make_unique<LocalOrbit>());
+            }
         }
-        return reference.reference_iterations;
     }
 
-    std::vector<ExplorationResult> explore_neighborhood(ComplexType const& center, FloatType scale_factor,
-                                                        const int radius, const iteration_count_t max_iterations)
+    // Orbit to be read by the calling worker thread: with `numa_local_orbits`
+    // the first worker on each NUMA node copies the reference orbit into
+    // memory local to that node once prepare() has set up the copies. As the
+    // orbit only grows between restarts, only the points appended since the
+    // last copy are copied.
+    OrbitPointType const* get_orbit(void)
     {
-        ReferenceOrbit reference;
-        reference.compute(center, max_iterations);
-        std::vector<ExplorationResult> results;
-        for (int i = -radius; i <= radius; ++i)
+        if (!numa_local_orbits || local_orbits.empty())
+            return reference.trajectory.data();
+        LocalOrbit& local = *local_orbits.at(get_current_numa_node() % local_orbits.size());
+        const std::size_t length = reference.trajectory.size();
+        if (local.generation != reference.generation || local.length != length)
         {
-            for (int j = -radius; j <= radius; ++j)
+            std::lock_guard<std::mutex> lock(local.mtx);
+            const std::size_t copied = (local.generation == reference.generation) ? local.length.load() : 0;
+            if (copied != length)
             {
-                ComplexType delta_c(scale_factor * i, scale_factor * j);
-                iteration_count_t approx_iterations = approximate_iterations(reference, delta_c);
-                ComplexType point = center + delta_c;
-                results.emplace_back(i, j, approx_iterations);
+                local.trajectory.grow(length, copied);
+                std::copy(reference.trajectory.data() + copied, reference.trajectory.data() + length,
+                          local.trajectory.data() + copied);
+                local.generation = reference.generation.load();
+                local.length = length;
             }
         }
-        return results;
+        return local.trajectory.data();
     }
 
-    void calculate_mandelbrot_row_range(thread_param const& p)
+    // Iterations of the point at Δc from the reference point. The orbit is
+    // rebased onto the start of the reference orbit when it gets closer to 0
+    // than to the reference, where the perturbation loses its precision, and
+    // when the reference orbit runs out because the reference escaped.
+    inline iteration_count_t approximate_iterations(OrbitPointType const* orbit, const iteration_count_t orbit_length,
+                                                    const iteration_count_t max_iterations, const double delta_c_real,
+                                                    const double delta_c_imag)
     {
-        const int r = p.radius;
-        FloatType const& scale_factor = p.scale_factor;
-        for (int y = p.start_row + r; y <= p.end_row - r; y += 2 * r)
+        double delta_real = 0;
+        double delta_imag = 0;
+        iteration_count_t n = 0; // index into the reference orbit
+        for (iteration_count_t iterations = 0; iterations < max_iterations; ++iterations)
         {
-            for (int x = 0; x < width - r; x += 2 * r)
+            const double z_real = orbit[n].real() + delta_real;
+            const double z_imag = orbit[n].imag() + delta_imag;
+            const double z_norm = z_real * z_real + z_imag * z_imag;
+            if (z_norm > 4)
+                return iterations;
+            if (z_norm < delta_real * delta_real + delta_imag * delta_imag || n + 1 == orbit_length)
             {
-                ComplexType center(p.real_start + scale_factor * x, p.imag_start + scale_factor * y);
-                std::vector<ExplorationResult> const& exploration_results =
-                    explore_neighborhood(center, scale_factor, r, p.max_iterations);
-                for (auto [dx, dy, iterations] : exploration_results)
-                {
-                    const int px = x + dx;
-                    const int py = y + dy;
-                    if (px < 0 || px >= width || py < p.start_row || py >= p.end_row)
-                        continue;
-                    const double hue = static_cast<double>(iterations) / static_cast<double>(p.max_iterations);
-                    p.image.setPixel(px, py - p.start_row,
-                                     (iterations < p.max_iterations) ? get_rainbow_color(hue) : sf::Color::Black);
-                }
+                delta_real = z_real;
+                delta_imag = z_imag;
+                n = 0;
+            }
+            const double ref_real = orbit[n].real();
+            const double ref_imag = orbit[n].imag();
+            // δ' = 2·Z·δ + δ² + Δc
+            const double next_real = 2 * (ref_real * delta_real - ref_imag * delta_imag) +
+                                     delta_real * delta_real - delta_imag * delta_imag + delta_c_real;
+            delta_imag = 2 * (ref_real * delta_imag + ref_imag * delta_real) + 2 * delta_real * delta_imag +
+                         delta_c_imag;
+            delta_real = next_real;
+            ++n;
+        }
+        return max_iterations;
+    }
+
+    // Like approximate_iterations, but also tracks the derivative of the orbit
+    inline distance_estimate approximate_distance(OrbitPointType const* orbit, const iteration_count_t orbit_length,
+                                                  const iteration_count_t max_iterations, const double delta_c_real,
+                                                  const double delta_c_imag)
+    {
+        double delta_real = 0;
+        double delta_imag = 0;
+        // derivative dz/dc of the full orbit Z+δ
+        double dz_real = 0;
+        double dz_imag = 0;
+        iteration_count_t n = 0; // index into the reference orbit
+        for (iteration_count_t iterations = 0; iterations < max_iterations; ++iterations)
+        {
+            const double z_real = orbit[n].real() + delta_real;
+            const double z_imag = orbit[n].imag() + delta_imag;
+            const double z_norm = z_real * z_real + z_imag * z_imag;
+            if (z_norm > 4)
+                return {iterations, estimate_distance(z_real, z_imag, dz_real, dz_imag,
+                                                      reference.reduced_center.real() + delta_c_real,
+                                                      reference.reduced_center.imag() + delta_c_imag)};
+            if (z_norm < delta_real * delta_real + delta_imag * delta_imag || n + 1 == orbit_length)
+            {
+                delta_real = z_real;
+                delta_imag = z_imag;
+                n = 0;
             }
-            completed_rows += 2 * r + 1;
+            const double ref_real = orbit[n].real();
+            const double ref_imag = orbit[n].imag();
+            // dz' = 2·z·dz + 1
+            const double next_dz_real = 2 * (z_real * dz_real - z_imag * dz_imag) + 1;
+            dz_imag = 2 * (z_real * dz_imag + z_imag * dz_real);
+            dz_real = next_dz_real;
+            // δ' = 2·Z·δ + δ² + Δc
+            const double next_real = 2 * (ref_real * delta_real - ref_imag * delta_imag) +
+                                     delta_real * delta_real - delta_imag * delta_imag + delta_c_real;
+            delta_imag = 2 * (ref_real * delta_imag + ref_imag * delta_real) + 2 * delta_real * delta_imag +
+                         delta_c_imag;
+            delta_real = next_real;
+            ++n;
+        }
+        return {max_iterations, 0};
+    }
+
+    void calculate_mandelbrot_row(work_item<FloatType> const& w)
+    {
+        if (w.image.getSize().x != static_cast<unsigned int>(width))
+        {
+            // allocated by the worker that fills the row, so it lands in the worker's local memory
+            w.image.create(width, 1, sf::Color::Transparent);
+        }
+        OrbitPointType const* orbit = get_orbit();
+        const iteration_count_t orbit_length = reference.trajectory.size();
+        const double delta_c_imag = center_offset_imag + w.scale_factor * (w.row - height / 2.0);
+        for (int x = 0; x < width; ++x)
+        {
+            const double delta_c_real = center_offset_real + w.scale_factor * (x - width / 2.0);
+            if (!distance_estimation)
+            {
+                const iteration_count_t iterations =
+                    approximate_iterations(orbit, orbit_length, w.max_iterations, delta_c_real, delta_c_imag);
+                const double hue = static_cast<double>(iterations) / static_cast<double>(w.max_iterations);
+                w.image.setPixel(x, 0, (iterations < w.max_iterations) ? get_rainbow_color(hue) : sf::Color::Black);
+                continue;
+            }
+            const distance_estimate de =
+                approximate_distance(orbit, orbit_length, w.max_iterations, delta_c_real, delta_c_imag);
+            const double pixel_distance = de.distance / w.scale_factor;
+            if (w.distances != nullptr)
+            {
+                w.distances[x] = static_cast<float>(pixel_distance);
+            }
+            if (supersampling > 1 && de.iterations < w.max_iterations && pixel_distance < 1)
+            {
+                w.image.setPixel(x, 0, supersample_pixel(supersampling, [&](double dx, double dy) {
+                                     const distance_estimate sample =
+                                         approximate_distance(orbit, orbit_length, w.max_iterations,
+                                                              delta_c_real + w.scale_factor * dx,
+                                                              delta_c_imag + w.scale_factor * dy);
+                                     return get_distance_color(sample.iterations, sample.distance / w.scale_factor,
+                                                               w.max_iterations);
+                                 }));
+                continue;
+            }
+            w.image.setPixel(x, 0, get_distance_color(de.iterations, pixel_distance, w.max_iterations));
+        }
+        ++completed_rows;
+    }
+
+    void calculate_exponential_map_row(exponential_map<FloatType>& strip, const int row)
+    {
+        OrbitPointType const* orbit = get_orbit();
+        const iteration_count_t max_iterations = strip.max_iterations.at(row);
+        const iteration_count_t orbit_length = reference.trajectory.size();
+        const double radius = std::exp(strip.log_radius(row));
+        std::uint32_t* data = strip.row_data(row);
+        for (int col = 0; col < strip.columns; ++col)
+        {
+            data[col] = strip.clamp_iterations(approximate_iterations(orbit, orbit_length, max_iterations,
+                                                                      center_offset_real + radius * strip.cosines[col],
+                                                                      center_offset_imag + radius * strip.sines[col]));
         }
+        ++strip.completed_rows;
     }
 };
 
@@ -0,0 +1,166 @@
+#ifndef __ORBIT_STORE_HPP__
+#define __ORBIT_STORE_HPP__
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Directory the orbit files are created in; the system's temporary directory if empty
+inline std::string orbit_dir;
+
+/**
+ * Append-only array of trivially copyable values (reference orbit points)
+ * that lives in an anonymous temporary file and is read back through a
+ * read-only memory mapping. The operating system pages the orbit in and
+ * out as needed, so it may be larger than the available RAM, and all
+ * worker threads share the same physical pages.
+ *
+ * Values pushed with `push_back()` become visible via `data()` and `size()`
+ * after the next call to `flush()`.
+ */
+template <typename T> class orbit_store
+{
+  public:
+    orbit_store() = default;
+    orbit_store(orbit_store const&) = delete;
+    orbit_store& operator=(orbit_store const&) = delete;
+
+    ~orbit_store()
+    {
+        unmap();
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+        }
+    }
+
+    void clear(void)
+    {
+        unmap();
+        buffer_.clear();
+        count_ = 0;
+        if (fd_ >= 0 && ::ftruncate(fd_, 0) != 0)
+        {
+            throw std::runtime_error("cannot truncate orbit file: " + std::string(std::strerror(errno)));
+        }
+    }
+
+    void push_back(T const& value)
+    {
+        buffer_.push_back(value);
+        if (buffer_.size() == buffer_capacity)
+        {
+            write_buffer();
+        }
+    }
+
+    void flush(void)
+    {
+        write_buffer();
+        if (count_ == mapped_count_)
+            return;
+        unmap();
+        if (count_ == 0)
+            return;
+        void* p = ::mmap(nullptr, count_ * sizeof(T), PROT_READ, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED)
+        {
+            throw std::runtime_error("cannot map orbit file: " + std::string(std::strerror(errno)));
+        }
+        data_ = static_cast<T const*>(p);
+        mapped_count_ = count_;
+    }
+
+    T const* data(void) const
+    {
+        return data_;
+    }
+
+    std::size_t size(void) const
+    {
+        return mapped_count_;
+    }
+
+    // Number of values pushed so far, including those not yet visible before the next flush()
+    std::size_t count(void) const
+    {
+        return count_ + buffer_.size();
+    }
+
+    bool empty(void) const
+    {
+        return count_ == 0 && buffer_.empty();
+    }
+
+  private:
+    static constexpr std::size_t buffer_capacity = 1U << 16;
+
+    void open(void)
+    {
+        std::filesystem::path const& dir =
+            orbit_dir.empty() ? std::filesystem::temp_directory_path() : std::filesystem::path(orbit_dir);
+        std::string path = (dir / "applecore-orbit-XXXXXX").string();
+        fd_ = ::mkstemp(path.data());
+        if (fd_ < 0)
+        {
+            throw std::runtime_error("cannot create orbit file " + path + ": " + std::strerror(errno));
+        }
+        // the file disappears as soon as it's closed
+        ::unlink(path.c_str());
+    }
+
+    void write_buffer(void)
+    {
+        if (buffer_.empty())
+            return;
+        if (fd_ < 0)
+        {
+            open();
+        }
+        char const* p = reinterpret_cast<char const*>(buffer_.data());
+        std::size_t remaining = buffer_.size() * sizeof(T);
+        off_t offset = static_cast<off_t>(count_ * sizeof(T));
+        while (remaining > 0)
+        {
+            ssize_t written = ::pwrite(fd_, p, remaining, offset);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("cannot write orbit file: " + std::string(std::strerror(errno)));
+            }
+            p += written;
+            offset += written;
+            remaining -= static_cast<std::size_t>(written);
+        }
+        count_ += buffer_.size();
+        buffer_.clear();
+    }
+
+    void unmap(void)
+    {
+        if (data_ != nullptr)
+        {
+            ::munmap(const_cast<T*>(data_), mapped_count_ * sizeof(T));
+            data_ = nullptr;
+        }
+        mapped_count_ = 0;
+    }
+
+    int fd_{-1};
+    T const* data_{nullptr};
+    std::size_t mapped_count_{0};
+    std::size_t count_{0};
+    std::vector<T> buffer_;
+};
+
+#endif // __ORBIT_STORE_HPP__
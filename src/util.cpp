@@ -5,6 +5,8 @@
 #include <sstream>
 #include <string>
 
+#include <unistd.h>
+
 sf::Color get_rainbow_color(double value)
 {
     int hue = static_cast<int>(value * 360) % 360;
@@ -72,3 +74,13 @@ std::string replace_substring(std::string const& str, const std::string& substri
     }
     return result;
 }
+
+// Size of the physical memory in bytes, 0 if unknown
+std::size_t get_physical_memory(void)
+{
+    const long pages = sysconf(_SC_PHYS_PAGES);
+    const long page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0)
+        return 0;
+    return static_cast<std::size_t>(pages) * static_cast<std::size_t>(page_size);
+}
@@ -3,6 +3,7 @@
 
 #include <SFML/Graphics.hpp>
 #include <chrono>
+#include <cstddef>
 #include <sstream>
 #include <string>
 
@@ -10,6 +11,7 @@ extern sf::Color get_rainbow_color(double);
 extern std::string get_iso_timestamp(std::chrono::system_clock::time_point const& t);
 extern std::string get_current_iso_timestamp(void);
 extern std::string replace_substring(std::string const& str, std::string const& substring, std::string const& value);
+extern std::size_t get_physical_memory(void);
 
 template <typename Duration> std::string format_duration(Duration dt)
 {